@@ -23,9 +23,25 @@
 */
 #include <stdlib.h> /* malloc, realloc, free */
 #include <stdint.h> /* SIZE_MAX */
+#include <string.h> /* memcpy */
 #include "libdo.h"
 #include "vector.h"
 
+#ifdef DO_THREADS
+# include <pthread.h>
+#endif
+
+#define DO_OFFLOAD_THREADS  2
+
+/* Adaptive mode, function predicates that are true less than 1/DO_ADAPTIVE_RARE of the time are */
+/* evaluated every 2nd, 4th... tick, up to DO_ADAPTIVE_MAX_SKIP ticks or 4x that for expensive ones */
+#define DO_ADAPTIVE_WINDOW      64u
+#define DO_ADAPTIVE_MIN_EVALS   16u
+#define DO_ADAPTIVE_RARE        16u
+#define DO_ADAPTIVE_MAX_SKIP    8u
+#define DO_ADAPTIVE_SAMPLE      8u
+#define DO_ADAPTIVE_RESORT      64u
+
 #undef malloc
 #undef realloc
 #undef free
@@ -34,18 +50,47 @@ static do_malloc_func do_malloc = malloc;
 static do_realloc_func do_realloc = realloc;
 static do_free_func do_free = free;
 
-static void do_remove(struct do_doer *doer, struct do_work *work);
+static void do_cleanup(struct do_doer *doer);
+
+static void do_summarize(struct do_doer *doer);
+
+static void do_pool_stop(struct do_doer *doer);
+
+static void do_complete(struct do_doer *doer, struct do_work *work);
+
+bool expire_work(void *work);
+
+void do_work_set_predicate_ptr_null(struct do_work *work);
+
+/* Bumped whenever a group is resumed or cancelled, so idle summaries can be invalidated in O(1) */
+static unsigned long do_group_epoch = 0;
 
 union predicate {
     bool *p;
     returns_true_func fn;
     time_t tm;
+    struct {
+        const long *p;
+        long value;
+        unsigned cmp;
+    } cmp;
+    struct {
+        const unsigned long *p;
+        unsigned long mask;
+    } mask;
 };
 
 enum predicate_type {
     DO_PREDICATE_PTR,
     DO_PREDICATE_FUNC,
-    DO_PREDICATE_TIME
+    DO_PREDICATE_TIME,
+    DO_PREDICATE_DOER,
+    DO_PREDICATE_CMP,
+    DO_PREDICATE_MASK,
+    DO_PREDICATE_TREE,
+    DO_PREDICATE_AND,
+    DO_PREDICATE_OR,
+    DO_PREDICATE_NOT
 };
 
 struct predicate_container {
@@ -53,16 +98,91 @@ struct predicate_container {
     union predicate predicate;
 };
 
+/* Relative evaluation costs, used to evaluate cheaper operands first */
+#define DO_PREDICATE_COST       1u
+#define DO_PREDICATE_FUNC_COST  8u
+
+/* Composite predicate node, leaves hold a predicate_container, AND/OR/NOT nodes hold operands */
+struct do_predicate {
+    struct predicate_container pc;
+    struct do_predicate *lhs;
+    struct do_predicate *rhs;
+    unsigned cost;
+};
+
 struct do_work {
     size_t prio;
     struct predicate_container pc;
     work_func work_fn;
     void *data;
+    struct do_doer *doer;
+    struct do_doer *child;
+    struct do_group *group;
+    unsigned long group_gen;
+    /* Rate limit, at most rate_runs runs every rate_period seconds */
+    size_t rate_runs;
+    size_t rate_tokens;
+    time_t rate_period;
+    time_t rate_start;
+    /* A time predicate may fire up to slack seconds late, to share a wakeup */
+    time_t slack;
+    bool has_deadline;
+    time_t deadline;
+    struct do_work *expirer;
+    size_t data_size;
+    /* Composite predicate, false before tree_tm if has_tree_tm */
+    struct do_predicate *tree;
+    bool has_tree_tm;
+    time_t tree_tm;
+    /* Offload, in-flight works are owned by the pool until their result is drained */
+    bool offload;
+    bool in_flight;
+    bool offload_result;
+    struct do_work *offload_next;
+    /* Adaptive mode statistics of function predicates, evals and hits decay every window */
+    unsigned evals;
+    unsigned hits;
+    unsigned long cost;
+    unsigned skip;
+    unsigned backoff;
+    /* Continuation, owned by this work until it completes, owned is set on the continuation */
+    struct do_work *then;
+    bool owned;
+};
+
+struct do_group {
+    size_t refs;
+    unsigned long gen;
+    bool paused;
 };
 
 struct do_doer {
     bool sorted;
     struct do_work **vector;
+    bool looping;
+    enum do_sched sched;
+    size_t admission;
+    /* Candidate works of the current tick, kept as a min-heap in EDF mode */
+    struct do_work **ready;
+    size_t offload_threads;
+    struct do_pool *pool;
+    do_clock_func clock_fn;
+    void *clock_ctx;
+    time_t now_tm;
+    bool adaptive;
+    unsigned long ticks;
+    /* Set once the doer is wrapped in a work, which owns it */
+    bool nested;
+    struct do_doer *parent;
+    /* Ready summary, valid unless dirty */
+    bool dirty;
+    size_t polled;
+    bool has_next_tm;
+    time_t next_tm;
+    unsigned long group_epoch;
+    /* Set for ticks at which a timer is due, slack timers then fire early */
+    bool coalescing;
+    struct do_timer_stats timer_stats;
 };
 
 
@@ -72,6 +192,28 @@ struct do_doer *do_init() {
     if (d) {
         d->sorted = true;
         d->vector = NULL;
+        d->looping = false;
+        d->sched = DO_SCHED_PRIO;
+        d->admission = 0;
+        d->ready = NULL;
+        d->offload_threads = DO_OFFLOAD_THREADS;
+        d->pool = NULL;
+        d->clock_fn = NULL;
+        d->clock_ctx = NULL;
+        d->now_tm = 0;
+        d->adaptive = false;
+        d->ticks = 0;
+        d->nested = false;
+        d->parent = NULL;
+        d->dirty = false;
+        d->polled = 0;
+        d->has_next_tm = false;
+        d->next_tm = 0;
+        d->group_epoch = do_group_epoch;
+        d->coalescing = false;
+        d->timer_stats.fired = 0;
+        d->timer_stats.wakeups = 0;
+        d->timer_stats.coalesced = 0;
     }
     return d;
 }
@@ -81,10 +223,12 @@ void do_destroy(struct do_doer *doer) {
     if (!doer) {
         return;
     }
+    do_pool_stop(doer);
     for (it = vector_begin(doer->vector); it != vector_end(doer->vector); it++) {
         do_work_destroy(*it);
     }
     vector_free(doer->vector);
+    vector_free(doer->ready);
     do_free(doer);
 }
 
@@ -95,6 +239,129 @@ void do_set_prio_changed(struct do_doer *doer) {
     }
 }
 
+bool do_set_offload_threads(struct do_doer *doer, size_t n) {
+#ifdef DO_THREADS
+    if (doer && n && !doer->pool) {
+        doer->offload_threads = n;
+        return true;
+    }
+#else
+    (void) doer;
+    (void) n;
+#endif
+    return false;
+}
+
+void do_set_clock(struct do_doer *doer, do_clock_func clock_fn, void *ctx) {
+    if (doer) {
+        doer->clock_fn = clock_fn;
+        doer->clock_ctx = ctx;
+    }
+}
+
+time_t do_manual_clock(void *ctx) {
+    return ctx ? *((time_t *) ctx) : 0;
+}
+
+/* Nested doers without a clock of their own share their parent's tick time */
+static time_t do_now(const struct do_doer *doer) {
+    if (doer->clock_fn) {
+        return doer->clock_fn(doer->clock_ctx);
+    }
+    if (doer->parent && doer->parent->looping) {
+        return doer->parent->now_tm;
+    }
+    return time(NULL);
+}
+
+bool do_next_wakeup(struct do_doer *doer, time_t *tm) {
+    if (!doer || !tm || doer->dirty || doer->polled || doer->group_epoch != do_group_epoch || !doer->has_next_tm) {
+        return false;
+    }
+    *tm = doer->next_tm;
+    return true;
+}
+
+void do_get_timer_stats(struct do_doer *doer, struct do_timer_stats *stats) {
+    if (doer && stats) {
+        *stats = doer->timer_stats;
+    }
+}
+
+void do_set_adaptive(struct do_doer *doer, bool adaptive) {
+    if (doer) {
+        doer->adaptive = adaptive;
+        doer->sorted = false;
+    }
+}
+
+void do_set_sched(struct do_doer *doer, enum do_sched sched) {
+    if (doer) {
+        doer->sched = sched;
+    }
+}
+
+void do_set_admission(struct do_doer *doer, size_t max_runs) {
+    if (doer) {
+        doer->admission = max_runs;
+    }
+}
+
+static void do_set_dirty(struct do_doer *doer) {
+    for (; doer && !doer->dirty; doer = doer->parent) {
+        doer->dirty = true;
+    }
+}
+
+static void do_summary_add_tm(struct do_doer *doer, time_t tm) {
+    if (!doer->has_next_tm || tm < doer->next_tm) {
+        doer->has_next_tm = true;
+        doer->next_tm = tm;
+    }
+}
+
+static void do_summary_add(struct do_doer *doer, const struct do_work *work) {
+    if (work->in_flight) {
+        /* Keep looping to pick up its result */
+        doer->polled++;
+        return;
+    }
+    if (work->group && work->group->paused) {
+        return;
+    }
+    if (work->rate_period && !work->rate_tokens) {
+        do_summary_add_tm(doer, work->rate_start + work->rate_period);
+        return;
+    }
+    switch (work->pc.pt) {
+        case DO_PREDICATE_TIME:
+            do_summary_add_tm(doer, work->pc.predicate.tm + work->slack);
+            break;
+        case DO_PREDICATE_TREE:
+            if (work->has_tree_tm) {
+                do_summary_add_tm(doer, work->tree_tm);
+            } else {
+                doer->polled++;
+            }
+            break;
+        case DO_PREDICATE_DOER:
+            if (work->child->dirty || work->child->polled || work->child->group_epoch != do_group_epoch) {
+                doer->polled++;
+            } else if (work->child->has_next_tm) {
+                do_summary_add_tm(doer, work->child->next_tm);
+            }
+            break;
+        default:
+            doer->polled++;
+            break;
+    }
+}
+
+static bool do_may_be_ready(const struct do_doer *doer, time_t now_tm) {
+    return doer->dirty || doer->polled || doer->group_epoch != do_group_epoch ||
+           (doer->has_next_tm && now_tm >= doer->next_tm);
+}
+
 
 /* Work */
 struct do_work *do_work_init() {
@@ -105,14 +372,64 @@ struct do_work *do_work_init() {
         work->pc.predicate.p = NULL;
         work->work_fn = NULL;
         work->data = NULL;
+        work->doer = NULL;
+        work->child = NULL;
+        work->group = NULL;
+        work->group_gen = 0;
+        work->rate_runs = 0;
+        work->rate_tokens = 0;
+        work->rate_period = 0;
+        work->rate_start = 0;
+        work->slack = 0;
+        work->has_deadline = false;
+        work->deadline = 0;
+        work->expirer = NULL;
+        work->data_size = 0;
+        work->tree = NULL;
+        work->has_tree_tm = false;
+        work->tree_tm = 0;
+        work->offload = false;
+        work->in_flight = false;
+        work->offload_result = false;
+        work->offload_next = NULL;
+        work->evals = 0;
+        work->hits = 0;
+        work->cost = 0;
+        work->skip = 0;
+        work->backoff = 0;
+        work->then = NULL;
+        work->owned = false;
     }
     return work;
 }
 
 void do_work_destroy(struct do_work *work) {
+    if (work && work->child) {
+        do_destroy(work->child);
+    }
+    if (work && work->group) {
+        do_group_destroy(work->group);
+    }
+    if (work && work->expirer) {
+        /* Expiring a destroyed work is a no-op */
+        work->expirer->data = NULL;
+        do_work_set_predicate_ptr_null(work->expirer);
+    }
+    if (work && work->work_fn == expire_work && work->data) {
+        ((struct do_work *) work->data)->expirer = NULL;
+    }
+    if (work) {
+        do_predicate_destroy(work->tree);
+        do_work_destroy(work->then);
+    }
     do_free(work);
 }
 
+static bool do_work_is_removed(const struct do_work *work) {
+    return (work->pc.pt == DO_PREDICATE_PTR && !work->pc.predicate.p) ||
+           (work->group && work->group_gen != work->group->gen);
+}
+
 void do_work_set_work_func(struct do_work *work, work_func work_fn) {
     if (work) {
         work->work_fn = work_fn;
@@ -125,6 +442,18 @@ void do_work_set_data(struct do_work *work, void *data) {
     }
 }
 
+void do_work_set_data_size(struct do_work *work, size_t size) {
+    if (work) {
+        work->data_size = size;
+    }
+}
+
+void do_work_set_offload(struct do_work *work, bool offload) {
+    if (work) {
+        work->offload = offload;
+    }
+}
+
 void do_work_set_prio(struct do_work *work, size_t prio) {
     if (work) {
         if (prio < 1) {
@@ -134,10 +463,38 @@ void do_work_set_prio(struct do_work *work, size_t prio) {
     }
 }
 
+void do_work_set_slack(struct do_work *work, time_t slack) {
+    if (work) {
+        work->slack = (slack > 0) ? slack : 0;
+        do_set_dirty(work->doer);
+    }
+}
+
+void do_work_set_deadline(struct do_work *work, time_t deadline) {
+    if (work) {
+        work->has_deadline = true;
+        work->deadline = deadline;
+    }
+}
+
+void do_work_set_rate_limit(struct do_work *work, size_t runs, time_t period) {
+    if (work) {
+        if (!runs || period < 0) {
+            period = 0;
+        }
+        work->rate_runs = runs;
+        work->rate_tokens = runs;
+        work->rate_period = period;
+        work->rate_start = 0;
+        do_set_dirty(work->doer);
+    }
+}
+
 void do_work_set_predicate_ptr(struct do_work *work, bool *predicate_p) {
     if (work && predicate_p) {
         work->pc.pt = DO_PREDICATE_PTR;
         work->pc.predicate.p = predicate_p;
+        do_set_dirty(work->doer);
     }
 }
 
@@ -148,10 +505,30 @@ void do_work_set_predicate_ptr_null(struct do_work *work) {
     }
 }
 
+void do_work_set_predicate_cmp(struct do_work *work, const long *value_p, enum do_cmp cmp, long value) {
+    if (work && value_p) {
+        work->pc.pt = DO_PREDICATE_CMP;
+        work->pc.predicate.cmp.p = value_p;
+        work->pc.predicate.cmp.value = value;
+        work->pc.predicate.cmp.cmp = (unsigned) cmp;
+        do_set_dirty(work->doer);
+    }
+}
+
+void do_work_set_predicate_mask(struct do_work *work, const unsigned long *word_p, unsigned long mask) {
+    if (work && word_p) {
+        work->pc.pt = DO_PREDICATE_MASK;
+        work->pc.predicate.mask.p = word_p;
+        work->pc.predicate.mask.mask = mask;
+        do_set_dirty(work->doer);
+    }
+}
+
 void do_work_set_predicate_func(struct do_work *work, returns_true_func predicate_fn) {
     if (work) {
         work->pc.pt = DO_PREDICATE_FUNC;
         work->pc.predicate.fn = predicate_fn;
+        do_set_dirty(work->doer);
     }
 }
 
@@ -159,6 +536,139 @@ void do_work_set_predicate_time(struct do_work *work, time_t predicate_tm) {
     if (work) {
         work->pc.pt = DO_PREDICATE_TIME;
         work->pc.predicate.tm = predicate_tm;
+        do_set_dirty(work->doer);
+    }
+}
+
+
+/* Predicates */
+static struct do_predicate *do_predicate_init(enum predicate_type pt, unsigned cost) {
+    struct do_predicate *predicate = (struct do_predicate *) do_malloc(sizeof(*predicate));
+    if (predicate) {
+        predicate->pc.pt = pt;
+        predicate->lhs = NULL;
+        predicate->rhs = NULL;
+        predicate->cost = cost;
+    }
+    return predicate;
+}
+
+struct do_predicate *do_predicate_ptr(bool *predicate_p) {
+    struct do_predicate *predicate = NULL;
+    if (predicate_p && (predicate = do_predicate_init(DO_PREDICATE_PTR, DO_PREDICATE_COST))) {
+        predicate->pc.predicate.p = predicate_p;
+    }
+    return predicate;
+}
+
+struct do_predicate *do_predicate_func(returns_true_func predicate_fn) {
+    struct do_predicate *predicate = NULL;
+    if (predicate_fn && (predicate = do_predicate_init(DO_PREDICATE_FUNC, DO_PREDICATE_FUNC_COST))) {
+        predicate->pc.predicate.fn = predicate_fn;
+    }
+    return predicate;
+}
+
+struct do_predicate *do_predicate_time(time_t predicate_tm) {
+    struct do_predicate *predicate = do_predicate_init(DO_PREDICATE_TIME, DO_PREDICATE_COST);
+    if (predicate) {
+        predicate->pc.predicate.tm = predicate_tm;
+    }
+    return predicate;
+}
+
+struct do_predicate *do_predicate_cmp(const long *value_p, enum do_cmp cmp, long value) {
+    struct do_predicate *predicate = NULL;
+    if (value_p && (predicate = do_predicate_init(DO_PREDICATE_CMP, DO_PREDICATE_COST))) {
+        predicate->pc.predicate.cmp.p = value_p;
+        predicate->pc.predicate.cmp.value = value;
+        predicate->pc.predicate.cmp.cmp = (unsigned) cmp;
+    }
+    return predicate;
+}
+
+struct do_predicate *do_predicate_mask(const unsigned long *word_p, unsigned long mask) {
+    struct do_predicate *predicate = NULL;
+    if (word_p && (predicate = do_predicate_init(DO_PREDICATE_MASK, DO_PREDICATE_COST))) {
+        predicate->pc.predicate.mask.p = word_p;
+        predicate->pc.predicate.mask.mask = mask;
+    }
+    return predicate;
+}
+
+static struct do_predicate *do_predicate_binary(enum predicate_type pt, struct do_predicate *lhs,
+                                                struct do_predicate *rhs) {
+    struct do_predicate *predicate = NULL;
+    if (lhs && rhs && (predicate = do_predicate_init(pt, lhs->cost + rhs->cost))) {
+        /* Cheaper operand first, so it short-circuits the expensive one */
+        predicate->lhs = (rhs->cost < lhs->cost) ? rhs : lhs;
+        predicate->rhs = (rhs->cost < lhs->cost) ? lhs : rhs;
+        return predicate;
+    }
+    do_predicate_destroy(lhs);
+    do_predicate_destroy(rhs);
+    return NULL;
+}
+
+struct do_predicate *do_predicate_and(struct do_predicate *lhs, struct do_predicate *rhs) {
+    return do_predicate_binary(DO_PREDICATE_AND, lhs, rhs);
+}
+
+struct do_predicate *do_predicate_or(struct do_predicate *lhs, struct do_predicate *rhs) {
+    return do_predicate_binary(DO_PREDICATE_OR, lhs, rhs);
+}
+
+struct do_predicate *do_predicate_not(struct do_predicate *operand) {
+    struct do_predicate *predicate = NULL;
+    if (operand && (predicate = do_predicate_init(DO_PREDICATE_NOT, operand->cost))) {
+        predicate->lhs = operand;
+        return predicate;
+    }
+    do_predicate_destroy(operand);
+    return NULL;
+}
+
+void do_predicate_destroy(struct do_predicate *predicate) {
+    if (predicate) {
+        do_predicate_destroy(predicate->lhs);
+        do_predicate_destroy(predicate->rhs);
+        do_free(predicate);
+    }
+}
+
+/* Earliest time the predicate can be true at, if its time terms bound it */
+static bool do_predicate_not_before(const struct do_predicate *predicate, time_t *tm) {
+    time_t l, r;
+    bool has_l, has_r;
+    switch (predicate->pc.pt) {
+        case DO_PREDICATE_TIME:
+            *tm = predicate->pc.predicate.tm;
+            return true;
+        case DO_PREDICATE_AND:
+            has_l = do_predicate_not_before(predicate->lhs, &l);
+            has_r = do_predicate_not_before(predicate->rhs, &r);
+            *tm = (has_l && (!has_r || l > r)) ? l : r;
+            return has_l || has_r;
+        case DO_PREDICATE_OR:
+            if (do_predicate_not_before(predicate->lhs, &l) && do_predicate_not_before(predicate->rhs, &r)) {
+                *tm = (l < r) ? l : r;
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+void do_work_set_predicate(struct do_work *work, struct do_predicate *predicate) {
+    if (work && predicate) {
+        if (work->tree != predicate) {
+            do_predicate_destroy(work->tree);
+        }
+        work->tree = predicate;
+        work->pc.pt = DO_PREDICATE_TREE;
+        work->has_tree_tm = do_predicate_not_before(predicate, &work->tree_tm);
+        do_set_dirty(work->doer);
     }
 }
 
@@ -197,92 +707,593 @@ struct do_work *do_work_after(work_func work_fn, void *data, time_t tm) {
     return NULL;
 }
 
+static bool do_loop_nested(void *data) {
+    do_loop((struct do_doer *) data);
+    return false;
+}
+
+struct do_work *do_work_doer(struct do_doer *child) {
+    struct do_work *work;
+    if (!child || child->nested) {
+        return NULL;
+    }
+    work = do_work_init();
+    if (work) {
+        do_work_set_work_func(work, do_loop_nested);
+        do_work_set_data(work, child);
+        work->pc.pt = DO_PREDICATE_DOER;
+        work->child = child;
+        child->nested = true;
+        return work;
+    }
+    return NULL;
+}
+
+/* Grows geometrically, unlike vector_push_back(), and reports failure instead of asserting */
+static bool do_reserve(struct do_work ***vec, size_t n) {
+    size_t sz = vector_size(*vec), cap = vector_capacity(*vec);
+    size_t *p;
+    if (cap >= sz + n) {
+        return true;
+    }
+    cap = (cap * 2 > sz + n) ? cap * 2 : sz + n;
+    p = (size_t *) do_realloc(*vec ? &((size_t *) *vec)[-2] : NULL,
+                              cap * sizeof(**vec) + sizeof(size_t) * 2);
+    if (!p) {
+        return false;
+    }
+    *vec = (struct do_work **) &p[2];
+    vector_set_capacity(*vec, cap);
+    vector_set_size(*vec, sz);
+    return true;
+}
+
+/* Priority order, refined in adaptive mode by putting more often true, then cheaper works first */
+static bool do_work_le(const struct do_work *a, const struct do_work *b, bool adaptive) {
+    unsigned long ra, rb;
+    if (!adaptive || a->prio != b->prio) {
+        return a->prio <= b->prio;
+    }
+    ra = (a->hits + 1UL) * (b->evals + 1UL);
+    rb = (b->hits + 1UL) * (a->evals + 1UL);
+    if (ra != rb) {
+        return ra > rb;
+    }
+    return a->cost <= b->cost;
+}
+
+/* Stable merge sort, tmp must hold sz works */
+static void do_sort_works(struct do_work **works, size_t sz, struct do_work **tmp, bool adaptive) {
+    size_t width, lo, i, j, k, mid, hi;
+    for (width = 1; width < sz; width *= 2) {
+        for (lo = 0; lo < sz - width; lo += 2 * width) {
+            mid = lo + width;
+            hi = (mid + width < sz) ? mid + width : sz;
+            for (i = lo, j = mid, k = lo; k < hi; ++k) {
+                if (j >= hi || (i < mid && do_work_le(works[i], works[j], adaptive))) {
+                    tmp[k] = works[i++];
+                } else {
+                    tmp[k] = works[j++];
+                }
+            }
+            memcpy(works + lo, tmp + lo, (hi - lo) * sizeof(*works));
+        }
+    }
+}
+
 void do_sort(struct do_doer *doer) {
     size_t sz, i, j;
+    struct do_work **tmp;
     if (!doer) {
         return;
     }
     sz = vector_size(doer->vector);
+    tmp = (struct do_work **) do_malloc(sz * sizeof(*tmp) + 1);
+    if (tmp) {
+        do_sort_works(doer->vector, sz, tmp, doer->adaptive);
+        do_free(tmp);
+        return;
+    }
+    /* Insertion sort doesn't need memory */
     for (i = 1; i < sz; ++i) {
-        for (j = 0; j < sz - 1; ++j) {
-            if (doer->vector[j]->prio > doer->vector[i]->prio) {
-                vector_swap(doer->vector, j, i, struct do_work *);
+        struct do_work *work = doer->vector[i];
+        for (j = i; j > 0 && !do_work_le(doer->vector[j - 1], work, doer->adaptive); --j) {
+            doer->vector[j] = doer->vector[j - 1];
+        }
+        doer->vector[j] = work;
+    }
+}
+
+
+/* Refills the work's tokens once its rate period has passed */
+static bool do_work_is_throttled(struct do_work *work, time_t now_tm) {
+    if (!work->rate_period) {
+        return false;
+    }
+    if (now_tm - work->rate_start >= work->rate_period) {
+        work->rate_start = now_tm;
+        work->rate_tokens = work->rate_runs;
+    }
+    return !work->rate_tokens;
+}
+
+static bool do_pc_eval(const struct predicate_container *pc, void *data, time_t now_tm) {
+    long v, c;
+    switch (pc->pt) {
+        case DO_PREDICATE_PTR:
+            return pc->predicate.p && *(pc->predicate.p);
+        case DO_PREDICATE_FUNC:
+            return pc->predicate.fn(data);
+        case DO_PREDICATE_TIME:
+            return now_tm >= pc->predicate.tm;
+        case DO_PREDICATE_CMP:
+            /* DO_CMP_* values are bit sets of <, == and >, so no branch per operator */
+            v = *(pc->predicate.cmp.p);
+            c = pc->predicate.cmp.value;
+            return (((v < c) | ((v == c) << 1) | ((v > c) << 2)) & pc->predicate.cmp.cmp) != 0;
+        case DO_PREDICATE_MASK:
+            return (*(pc->predicate.mask.p) & pc->predicate.mask.mask) != 0;
+        default:
+            return false;
+    }
+}
+
+static bool do_predicate_eval(const struct do_predicate *predicate, void *data, time_t now_tm) {
+    switch (predicate->pc.pt) {
+        case DO_PREDICATE_AND:
+            return do_predicate_eval(predicate->lhs, data, now_tm) && do_predicate_eval(predicate->rhs, data, now_tm);
+        case DO_PREDICATE_OR:
+            return do_predicate_eval(predicate->lhs, data, now_tm) || do_predicate_eval(predicate->rhs, data, now_tm);
+        case DO_PREDICATE_NOT:
+            return !do_predicate_eval(predicate->lhs, data, now_tm);
+        default:
+            return do_pc_eval(&predicate->pc, data, now_tm);
+    }
+}
+
+/* Backs off function predicates that are rarely true, and samples their cost */
+static bool do_adaptive_eval(struct do_work *work) {
+    bool is_tbd, sample;
+    clock_t start = 0;
+    if (work->skip) {
+        work->skip--;
+        return false;
+    }
+    sample = (work->evals % DO_ADAPTIVE_SAMPLE) == 0;
+    if (sample) {
+        start = clock();
+    }
+    is_tbd = work->pc.predicate.fn(work->data);
+    if (sample) {
+        work->cost = (work->cost * 7 + (unsigned long) (clock() - start)) / 8;
+    }
+    work->evals++;
+    if (is_tbd) {
+        work->hits++;
+    }
+    if (work->evals >= DO_ADAPTIVE_WINDOW) {
+        work->evals /= 2;
+        work->hits /= 2;
+    }
+    if (is_tbd) {
+        work->backoff = 0;
+    } else if (work->evals >= DO_ADAPTIVE_MIN_EVALS && work->hits * DO_ADAPTIVE_RARE < work->evals) {
+        unsigned max_skip = work->cost ? 4 * DO_ADAPTIVE_MAX_SKIP : DO_ADAPTIVE_MAX_SKIP;
+        work->backoff = work->backoff ? 2 * work->backoff : 1;
+        if (work->backoff > max_skip) {
+            work->backoff = max_skip;
+        }
+        work->skip = work->backoff;
+    }
+    return is_tbd;
+}
+
+static bool do_work_is_tbd(struct do_work *work, time_t now_tm) {
+    switch (work->pc.pt) {
+        case DO_PREDICATE_FUNC:
+            if (work->doer->adaptive) {
+                return do_adaptive_eval(work);
             }
+            return work->pc.predicate.fn(work->data);
+        case DO_PREDICATE_TIME:
+            return now_tm >= work->pc.predicate.tm &&
+                   (now_tm >= work->pc.predicate.tm + work->slack || work->doer->coalescing);
+        case DO_PREDICATE_DOER:
+            return do_may_be_ready(work->child, now_tm);
+        case DO_PREDICATE_TREE:
+            if (work->has_tree_tm && now_tm < work->tree_tm) {
+                return false;
+            }
+            return do_predicate_eval(work->tree, work->data, now_tm);
+        default:
+            return do_pc_eval(&work->pc, work->data, now_tm);
+    }
+}
+
+
+/* EDF order, works without a deadline come last and ties are broken by priority */
+static bool do_work_before(const struct do_work *a, const struct do_work *b) {
+    if (a->has_deadline != b->has_deadline) {
+        return a->has_deadline;
+    }
+    if (a->has_deadline && a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return a->prio < b->prio;
+}
+
+static void do_heap_sift_down(struct do_work **heap, size_t sz, size_t i) {
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < sz && do_work_before(heap[l], heap[min])) {
+            min = l;
+        }
+        if (r < sz && do_work_before(heap[r], heap[min])) {
+            min = r;
+        }
+        if (min == i) {
+            return;
         }
+        vector_swap(heap, i, min, struct do_work *);
+        i = min;
     }
 }
 
+static bool do_work_is_due(struct do_work *work, time_t now_tm) {
+    return !work->in_flight && !do_work_is_removed(work) && !(work->group && work->group->paused) &&
+           !do_work_is_throttled(work, now_tm) && do_work_is_tbd(work, now_tm);
+}
 
-/* Lifecycle */
-size_t do_loop(struct do_doer *doer) {
-    struct do_work **it, **itbegin, **itend;
-    size_t i = 0, oldsz = 0;
-    time_t now_tm = time(NULL);
-    if (!doer) {
-        return 0;
+/* Offload */
+#ifdef DO_THREADS
+struct do_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    size_t n_threads;
+    bool stop;
+    struct do_work *jobs_head;
+    struct do_work *jobs_tail;
+    struct do_work *done;
+};
+
+static void *do_pool_worker(void *arg) {
+    struct do_pool *pool = (struct do_pool *) arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct do_work *work;
+        bool result;
+        while (!pool->stop && !pool->jobs_head) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        work = pool->jobs_head;
+        pool->jobs_head = work->offload_next;
+        if (!pool->jobs_head) {
+            pool->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        result = work->work_fn && work->work_fn(work->data);
+        pthread_mutex_lock(&pool->lock);
+        work->offload_result = result;
+        work->offload_next = pool->done;
+        pool->done = work;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool do_pool_start(struct do_doer *doer) {
+    struct do_pool *pool = (struct do_pool *) do_malloc(sizeof(*pool));
+    if (!pool) {
+        return false;
+    }
+    pool->threads = (pthread_t *) do_malloc(doer->offload_threads * sizeof(*pool->threads));
+    if (!pool->threads) {
+        do_free(pool);
+        return false;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->stop = false;
+    pool->jobs_head = NULL;
+    pool->jobs_tail = NULL;
+    pool->done = NULL;
+    for (pool->n_threads = 0; pool->n_threads < doer->offload_threads; pool->n_threads++) {
+        if (pthread_create(&pool->threads[pool->n_threads], NULL, do_pool_worker, pool)) {
+            break;
+        }
+    }
+    doer->pool = pool;
+    if (!pool->n_threads) {
+        do_pool_stop(doer);
+        return false;
+    }
+    return true;
+}
+
+static void do_pool_stop(struct do_doer *doer) {
+    size_t i;
+    struct do_pool *pool = doer->pool;
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->n_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    do_free(pool->threads);
+    do_free(pool);
+    doer->pool = NULL;
+}
+
+static bool do_pool_submit(struct do_doer *doer, struct do_work *work) {
+    struct do_pool *pool;
+    if (!doer->pool && !do_pool_start(doer)) {
+        return false;
+    }
+    pool = doer->pool;
+    work->in_flight = true;
+    work->offload_next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->jobs_tail) {
+        pool->jobs_tail->offload_next = work;
+    } else {
+        pool->jobs_head = work;
     }
+    pool->jobs_tail = work;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/* Applies the results of completed works on the loop's thread */
+static void do_pool_drain(struct do_doer *doer) {
+    struct do_work *work;
+    if (!doer->pool) {
+        return;
+    }
+    pthread_mutex_lock(&doer->pool->lock);
+    work = doer->pool->done;
+    doer->pool->done = NULL;
+    pthread_mutex_unlock(&doer->pool->lock);
+    while (work) {
+        struct do_work *next = work->offload_next;
+        work->in_flight = false;
+        work->offload_next = NULL;
+        if (do_work_is_removed(work)) {
+            /* Removed while in flight, its continuation is dropped with it */
+            do_work_destroy(work->then);
+            work->then = NULL;
+        } else if (work->offload_result) {
+            do_complete(doer, work);
+        }
+        work = next;
+    }
+}
+#else
+static void do_pool_stop(struct do_doer *doer) {
+    (void) doer;
+}
+
+static bool do_pool_submit(struct do_doer *doer, struct do_work *work) {
+    (void) doer;
+    (void) work;
+    return false;
+}
+
+static void do_pool_drain(struct do_doer *doer) {
+    (void) doer;
+}
+#endif
+
+static void do_exec(struct do_doer *doer, struct do_work *work) {
+    if (work->offload && do_pool_submit(doer, work)) {
+        return;
+    }
+    if (work->work_fn && work->work_fn(work->data)) {
+        do_complete(doer, work);
+    }
+}
+
+/* Removes the work and runs its continuation right away, without evaluating its predicate */
+static void do_complete(struct do_doer *doer, struct do_work *work) {
+    struct do_work *then = work->then;
+    work->then = NULL;
+    do_not_do(doer, work);
+    if (then) {
+        then->owned = false;
+        if (do_so(doer, then)) {
+            do_exec(doer, then);
+        } else {
+            do_work_destroy(then);
+        }
+    }
+}
+
+static void do_run(struct do_doer *doer, struct do_work *work) {
+    if (work->rate_period) {
+        work->rate_tokens--;
+    }
+    /* Timers are counted when they run, so works held back by admission aren't */
+    if (work->pc.pt == DO_PREDICATE_TIME) {
+        doer->timer_stats.fired++;
+        if (doer->now_tm < work->pc.predicate.tm + work->slack) {
+            doer->timer_stats.coalesced++;
+        }
+    }
+    do_exec(doer, work);
+}
+
+static void do_loop_prio(struct do_doer *doer, time_t now_tm) {
+    size_t i, runs = 0, sz = vector_size(doer->vector);
     if (!doer->sorted) {
         do_sort(doer);
         doer->sorted = true;
     }
-    itbegin = vector_begin(doer->vector);
-    itend = vector_end(doer->vector);
-    oldsz = vector_size(doer->vector);
-    for (it = itbegin; it != itend; it++, i++) {
-        bool is_tbd = false;
-        switch ((*it)->pc.pt) {
-            case DO_PREDICATE_PTR:
-                if ((*it)->pc.predicate.p) {
-                    is_tbd = *((*it)->pc.predicate.p);
-                } else {
-                    do_not_do(doer, *it);
-                }
-                break;
-            case DO_PREDICATE_FUNC:
-                is_tbd = (*it)->pc.predicate.fn((*it)->data);
-                break;
-            case DO_PREDICATE_TIME:
-                is_tbd = (now_tm >= (*it)->pc.predicate.tm);
-                break;
-        }
-
-        if (is_tbd) {
-            if ((*it)->work_fn && (*it)->work_fn((*it)->data)) {
-                if (vector_size(doer->vector) > oldsz) {
-                    /* Adjust iterators */
-                    size_t j = i;
-                    it = vector_begin(doer->vector);
-                    while (j--) it++;
-                    itend = vector_begin(doer->vector);
-                    j = oldsz;
-                    while (j--) itend++;
-                }
-                do_not_do(doer, *it);
-            }
+    for (i = 0; i < sz && (!doer->admission || runs < doer->admission); ++i) {
+        /* Works may be added from within work functions, so don't hold on to iterators */
+        struct do_work *work = doer->vector[i];
+        if (do_work_is_due(work, now_tm)) {
+            do_run(doer, work);
+            runs++;
         }
     }
-    for (it = vector_begin(doer->vector); it != vector_end(doer->vector);) {
-        if ((*it)->pc.pt == DO_PREDICATE_PTR && !(*it)->pc.predicate.p) {
-            do_remove(doer, *it);
-            continue;
+}
+
+static void do_loop_edf(struct do_doer *doer, time_t now_tm) {
+    size_t i, runs = 0, sz = vector_size(doer->vector);
+    vector_set_size(doer->ready, 0);
+    if (!do_reserve(&doer->ready, sz)) {
+        return;
+    }
+    /* Only ready works are ordered, works made ready by them run on the next tick */
+    for (i = 0; i < sz; ++i) {
+        struct do_work *work = doer->vector[i];
+        if (do_work_is_due(work, now_tm)) {
+            vector_push_back(doer->ready, work, struct do_work *);
+        }
+    }
+    sz = vector_size(doer->ready);
+    for (i = sz / 2; i-- > 0;) {
+        do_heap_sift_down(doer->ready, sz, i);
+    }
+    while (sz && (!doer->admission || runs < doer->admission)) {
+        struct do_work *work = doer->ready[0];
+        doer->ready[0] = doer->ready[--sz];
+        do_heap_sift_down(doer->ready, sz, 0);
+        /* Earlier works may have removed this one or cleared its predicate */
+        if (!runs || do_work_is_due(work, now_tm)) {
+            do_run(doer, work);
+            runs++;
         }
-        it++;
     }
-    return vector_size(doer->vector);
 }
 
-bool do_so(struct do_doer *doer, struct do_work *work) {
-    if (doer && work) {
-        size_t oldsz = vector_size(doer->vector);
-        vector_push_back(doer->vector, work, struct do_work *);
+
+/* Lifecycle */
+size_t do_loop(struct do_doer *doer) {
+    time_t now_tm;
+    unsigned long fired;
+    if (!doer) {
+        return 0;
+    }
+    do_pool_drain(doer);
+    now_tm = doer->now_tm = do_now(doer);
+    if (doer->adaptive && ++doer->ticks % DO_ADAPTIVE_RESORT == 0) {
         do_set_prio_changed(doer);
-        if (vector_size(doer->vector) > oldsz) {
+    }
+    doer->looping = true;
+    if (doer->dirty) {
+        do_summarize(doer);
+    }
+    doer->coalescing = doer->has_next_tm && now_tm >= doer->next_tm;
+    fired = doer->timer_stats.fired;
+    if (doer->sched == DO_SCHED_EDF) {
+        do_loop_edf(doer, now_tm);
+    } else {
+        do_loop_prio(doer, now_tm);
+    }
+    if (doer->timer_stats.fired != fired) {
+        doer->timer_stats.wakeups++;
+    }
+    doer->looping = false;
+    do_cleanup(doer);
+    return vector_size(doer->vector);
+}
+
+static bool do_is_ancestor(const struct do_doer *doer, const struct do_doer *ancestor) {
+    for (; doer; doer = doer->parent) {
+        if (doer == ancestor) {
             return true;
         }
     }
     return false;
 }
 
+static bool do_can_so(struct do_doer *doer, const struct do_work *work) {
+    return work && !work->owned && !(work->child && (work->child->parent || do_is_ancestor(doer, work->child)));
+}
+
+static void do_adopt(struct do_doer *doer, struct do_work *work) {
+    work->doer = doer;
+    if (work->child) {
+        work->child->parent = doer;
+    }
+}
+
+bool do_so(struct do_doer *doer, struct do_work *work) {
+    if (doer && do_can_so(doer, work) && do_reserve(&doer->vector, 1)) {
+        doer->vector[vector_size(doer->vector)] = work;
+        vector_set_size(doer->vector, vector_size(doer->vector) + 1);
+        do_adopt(doer, work);
+        do_set_prio_changed(doer);
+        do_set_dirty(doer);
+        return true;
+    }
+    return false;
+}
+
+bool do_so_batch(struct do_doer *doer, struct do_work **works, size_t n) {
+    size_t i, j, k, sz;
+    struct do_work **batch;
+    if (!doer || (n && !works)) {
+        return false;
+    }
+    if (!n) {
+        return true;
+    }
+    for (i = 0; i < n; ++i) {
+        /* The same child doer may not appear twice in a batch either */
+        if (!do_can_so(doer, works[i])) {
+            return false;
+        }
+        for (j = 0; works[i]->child && j < i; ++j) {
+            if (works[j]->child == works[i]->child) {
+                return false;
+            }
+        }
+    }
+    sz = vector_size(doer->vector);
+    batch = (struct do_work **) do_malloc(2 * n * sizeof(*batch) + 1);
+    if (!batch || !do_reserve(&doer->vector, n)) {
+        do_free(batch);
+        return false;
+    }
+    for (i = 0; i < n; ++i) {
+        do_adopt(doer, works[i]);
+    }
+    do_set_dirty(doer);
+    if (doer->looping || !doer->sorted) {
+        /* Don't reorder works under a running loop, append and sort later */
+        memcpy(doer->vector + sz, works, n * sizeof(*works));
+        vector_set_size(doer->vector, sz + n);
+        do_set_prio_changed(doer);
+        do_free(batch);
+        return true;
+    }
+    memcpy(batch, works, n * sizeof(*works));
+    do_sort_works(batch, n, batch + n, false);
+    /* Merge from the back, existing works stay ahead of new ones of equal priority */
+    for (i = sz, j = n, k = sz + n; j > 0; --k) {
+        if (i > 0 && doer->vector[i - 1]->prio > batch[j - 1]->prio) {
+            doer->vector[k - 1] = doer->vector[--i];
+        } else {
+            doer->vector[k - 1] = batch[--j];
+        }
+    }
+    vector_set_size(doer->vector, sz + n);
+    do_free(batch);
+    return true;
+}
+
 bool expire_work(void *work) {
     if (work) {
         do_work_set_predicate_ptr_null((struct do_work *) work);
@@ -292,7 +1303,7 @@ bool expire_work(void *work) {
 
 bool do_so_until(struct do_doer *doer, struct do_work *work, time_t expiry_tm) {
     struct do_work *expirer;
-    if (!doer || !work) {
+    if (!doer || !do_can_so(doer, work)) {
         return false;
     }
     expirer = do_work_after(expire_work, work, expiry_tm);
@@ -300,9 +1311,11 @@ bool do_so_until(struct do_doer *doer, struct do_work *work, time_t expiry_tm) {
         expirer->prio = 0;
         if (do_so(doer, expirer)) {
             if (do_so(doer, work)) {
+                work->expirer = expirer;
                 return true;
             } else {
                 do_work_destroy(work);
+                do_work_set_data(expirer, NULL);
                 do_not_do(doer, expirer);
             }
         } else {
@@ -314,23 +1327,410 @@ bool do_so_until(struct do_doer *doer, struct do_work *work, time_t expiry_tm) {
 
 void do_not_do(struct do_doer *doer, struct do_work *work) {
     (void) doer;
+    if (work && work->expirer) {
+        do_work_set_predicate_ptr_null(work->expirer);
+    }
     do_work_set_predicate_ptr_null(work);
 }
 
-void do_remove(struct do_doer *doer, struct do_work *work) {
-    struct do_work **it;
+bool do_then(struct do_work *work, struct do_work *then) {
+    struct do_work *it;
+    if (!work || !then || work->then || then->doer || then->owned) {
+        return false;
+    }
+    for (it = then; it; it = it->then) {
+        if (it == work) {
+            return false;
+        }
+    }
+    work->then = then;
+    then->owned = true;
+    return true;
+}
+
+void do_not_do_batch(struct do_doer *doer, struct do_work **works, size_t n) {
     size_t i;
-    if (!doer || !work) {
-        return;
+    for (i = 0; works && i < n; ++i) {
+        do_not_do(doer, works[i]);
+    }
+}
+
+static void do_summary_reset(struct do_doer *doer) {
+    doer->dirty = false;
+    doer->polled = 0;
+    doer->has_next_tm = false;
+    doer->group_epoch = do_group_epoch;
+}
+
+static void do_summarize(struct do_doer *doer) {
+    struct do_work **it;
+    do_summary_reset(doer);
+    for (it = vector_begin(doer->vector); it != vector_end(doer->vector); it++) {
+        do_summary_add(doer, *it);
     }
-    i = 0;
-    for (it = vector_begin(doer->vector); it != vector_end(doer->vector); i++, it++) {
-        if (work == *it) {
-            vector_erase(doer->vector, i);
+}
+
+/* Drops removed works in a single pass and rebuilds the ready summary */
+static void do_cleanup(struct do_doer *doer) {
+    size_t i, j, sz = vector_size(doer->vector);
+    do_summary_reset(doer);
+    for (i = 0, j = 0; i < sz; ++i) {
+        struct do_work *work = doer->vector[i];
+        if (do_work_is_removed(work) && !work->in_flight) {
             do_work_destroy(work);
-            return;
+            continue;
         }
+        do_summary_add(doer, work);
+        doer->vector[j++] = work;
     }
+    vector_set_size(doer->vector, j);
+}
+
+
+/* Groups */
+struct do_group *do_group_init() {
+    struct do_group *group = (struct do_group *) do_malloc(sizeof(*group));
+    if (group) {
+        group->refs = 1;
+        group->gen = 0;
+        group->paused = false;
+    }
+    return group;
+}
+
+void do_group_destroy(struct do_group *group) {
+    if (group && !--group->refs) {
+        do_free(group);
+    }
+}
+
+bool do_so_in_group(struct do_doer *doer, struct do_work *work, struct do_group *group) {
+    if (!group || !work || work->group) {
+        return false;
+    }
+    if (do_so(doer, work)) {
+        group->refs++;
+        work->group = group;
+        work->group_gen = group->gen;
+        return true;
+    }
+    return false;
+}
+
+void do_group_cancel(struct do_group *group) {
+    if (group) {
+        group->gen++;
+        do_group_epoch++;
+    }
+}
+
+void do_group_pause(struct do_group *group) {
+    if (group) {
+        group->paused = true;
+    }
+}
+
+void do_group_resume(struct do_group *group) {
+    if (group && group->paused) {
+        group->paused = false;
+        do_group_epoch++;
+    }
+}
+
+
+/* Snapshots */
+#define DO_SNAPSHOT_MAGIC   0x4c444f31UL  /* "LDO1" */
+
+#define DO_SNAPSHOT_WORK_FN     0x01u
+#define DO_SNAPSHOT_DEADLINE    0x02u
+#define DO_SNAPSHOT_EXPIRY      0x04u
+#define DO_SNAPSHOT_OFFLOAD     0x08u
+
+struct do_registry_entry {
+    unsigned long id;
+    work_func work_fn;
+    returns_true_func predicate_fn;
+};
+
+static struct do_registry_entry *do_registry = NULL;
+
+/* Native layout, so a snapshot is only valid for the build that wrote it */
+struct do_snapshot_header {
+    unsigned long magic;
+    size_t size;
+    size_t count;
+};
+
+struct do_snapshot_work {
+    size_t prio;
+    unsigned flags;
+    enum predicate_type pt;
+    time_t tm;
+    unsigned long work_fn_id;
+    unsigned long predicate_fn_id;
+    time_t deadline;
+    time_t expiry_tm;
+    size_t expiry_prio;
+    size_t rate_runs;
+    time_t rate_period;
+    time_t slack;
+    size_t data_off;
+    size_t data_size;
+};
+
+union do_snapshot_align {
+    long l;
+    double d;
+    void *p;
+    size_t sz;
+    time_t tm;
+};
+
+static size_t do_snapshot_align(size_t off) {
+    size_t align = sizeof(union do_snapshot_align);
+    return (off + align - 1) / align * align;
+}
+
+static struct do_registry_entry *do_registry_find(unsigned long id) {
+    struct do_registry_entry *it;
+    for (it = vector_begin(do_registry); it != vector_end(do_registry); it++) {
+        if (it->id == id) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static bool do_registry_find_id(work_func work_fn, returns_true_func predicate_fn, unsigned long *id) {
+    struct do_registry_entry *it;
+    for (it = vector_begin(do_registry); it != vector_end(do_registry); it++) {
+        if ((work_fn && it->work_fn == work_fn) || (predicate_fn && it->predicate_fn == predicate_fn)) {
+            *id = it->id;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool do_register(unsigned long id, work_func work_fn, returns_true_func predicate_fn) {
+    struct do_registry_entry *entry = do_registry_find(id);
+    if (entry) {
+        if ((work_fn && entry->work_fn) || (predicate_fn && entry->predicate_fn)) {
+            return false;
+        }
+        if (work_fn) {
+            entry->work_fn = work_fn;
+        } else {
+            entry->predicate_fn = predicate_fn;
+        }
+    } else {
+        struct do_registry_entry e;
+        e.id = id;
+        e.work_fn = work_fn;
+        e.predicate_fn = predicate_fn;
+        vector_push_back(do_registry, e, struct do_registry_entry);
+    }
+    return true;
+}
+
+bool do_register_work_func(unsigned long id, work_func work_fn) {
+    return work_fn && do_register(id, work_fn, NULL);
+}
+
+bool do_register_predicate_func(unsigned long id, returns_true_func predicate_fn) {
+    return predicate_fn && do_register(id, NULL, predicate_fn);
+}
+
+void do_clear_registry() {
+    vector_free(do_registry);
+    do_registry = NULL;
+}
+
+/* Fills in a snapshot record, returns false for works tied to runtime objects */
+static bool do_snapshot_work_get(const struct do_work *work, struct do_snapshot_work *rec) {
+    if (do_work_is_removed(work) || work->in_flight || work->work_fn == expire_work || work->child || work->group ||
+        work->then || (work->data && !work->data_size)) {
+        return false;
+    }
+    rec->prio = work->prio;
+    rec->flags = 0;
+    rec->pt = work->pc.pt;
+    rec->tm = 0;
+    rec->work_fn_id = 0;
+    rec->predicate_fn_id = 0;
+    switch (work->pc.pt) {
+        case DO_PREDICATE_FUNC:
+            if (!do_registry_find_id(NULL, work->pc.predicate.fn, &rec->predicate_fn_id)) {
+                return false;
+            }
+            break;
+        case DO_PREDICATE_TIME:
+            rec->tm = work->pc.predicate.tm;
+            break;
+        default:
+            return false;
+    }
+    if (work->work_fn) {
+        if (!do_registry_find_id(work->work_fn, NULL, &rec->work_fn_id)) {
+            return false;
+        }
+        rec->flags |= DO_SNAPSHOT_WORK_FN;
+    }
+    rec->deadline = work->deadline;
+    if (work->has_deadline) {
+        rec->flags |= DO_SNAPSHOT_DEADLINE;
+    }
+    if (work->offload) {
+        rec->flags |= DO_SNAPSHOT_OFFLOAD;
+    }
+    rec->expiry_tm = 0;
+    rec->expiry_prio = 0;
+    if (work->expirer) {
+        rec->flags |= DO_SNAPSHOT_EXPIRY;
+        rec->expiry_tm = work->expirer->pc.predicate.tm;
+        rec->expiry_prio = work->expirer->prio;
+    }
+    rec->rate_runs = work->rate_runs;
+    rec->rate_period = work->rate_period;
+    rec->slack = work->slack;
+    rec->data_off = 0;
+    rec->data_size = work->data ? work->data_size : 0;
+    return true;
+}
+
+size_t do_snapshot(struct do_doer *doer, void *buf, size_t len) {
+    struct do_snapshot_header header;
+    struct do_snapshot_work rec;
+    struct do_work **it;
+    size_t data_off;
+    if (!doer) {
+        return 0;
+    }
+    header.magic = DO_SNAPSHOT_MAGIC;
+    header.count = 0;
+    header.size = 0;
+    for (it = vector_begin(doer->vector); it != vector_end(doer->vector); it++) {
+        if (do_snapshot_work_get(*it, &rec)) {
+            header.count++;
+            header.size = do_snapshot_align(header.size + rec.data_size);
+        }
+    }
+    data_off = do_snapshot_align(sizeof(header) + header.count * sizeof(rec));
+    header.size += data_off;
+    if (!buf || len < header.size) {
+        return header.size;
+    }
+    memcpy(buf, &header, sizeof(header));
+    header.count = 0;
+    for (it = vector_begin(doer->vector); it != vector_end(doer->vector); it++) {
+        if (do_snapshot_work_get(*it, &rec)) {
+            if (rec.data_size) {
+                rec.data_off = data_off;
+                memcpy((char *) buf + data_off, (*it)->data, rec.data_size);
+                data_off = do_snapshot_align(data_off + rec.data_size);
+            }
+            memcpy((char *) buf + sizeof(header) + header.count++ * sizeof(rec), &rec, sizeof(rec));
+        }
+    }
+    return header.size;
+}
+
+static struct do_work *do_restore_work(const struct do_snapshot_work *rec, char *buf) {
+    struct do_registry_entry *entry;
+    struct do_work *work = do_work_init();
+    if (!work) {
+        return NULL;
+    }
+    work->prio = rec->prio;
+    if (rec->pt == DO_PREDICATE_TIME) {
+        work->pc.pt = DO_PREDICATE_TIME;
+        work->pc.predicate.tm = rec->tm;
+    } else {
+        entry = do_registry_find(rec->predicate_fn_id);
+        if (!entry || !entry->predicate_fn) {
+            do_work_destroy(work);
+            return NULL;
+        }
+        work->pc.pt = DO_PREDICATE_FUNC;
+        work->pc.predicate.fn = entry->predicate_fn;
+    }
+    if (rec->flags & DO_SNAPSHOT_WORK_FN) {
+        entry = do_registry_find(rec->work_fn_id);
+        if (!entry || !entry->work_fn) {
+            do_work_destroy(work);
+            return NULL;
+        }
+        work->work_fn = entry->work_fn;
+    }
+    if (rec->data_size) {
+        work->data = buf + rec->data_off;
+        work->data_size = rec->data_size;
+    }
+    work->has_deadline = (rec->flags & DO_SNAPSHOT_DEADLINE) != 0;
+    work->offload = (rec->flags & DO_SNAPSHOT_OFFLOAD) != 0;
+    work->deadline = rec->deadline;
+    do_work_set_rate_limit(work, rec->rate_runs, rec->rate_period);
+    do_work_set_slack(work, rec->slack);
+    if (rec->flags & DO_SNAPSHOT_EXPIRY) {
+        work->expirer = do_work_after(expire_work, work, rec->expiry_tm);
+        if (!work->expirer) {
+            do_work_destroy(work);
+            return NULL;
+        }
+        work->expirer->prio = rec->expiry_prio;
+    }
+    return work;
+}
+
+bool do_restore(struct do_doer *doer, void *buf, size_t len) {
+    struct do_snapshot_header header;
+    struct do_snapshot_work rec;
+    size_t i, sz, count;
+    if (!doer || !buf || len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != DO_SNAPSHOT_MAGIC || header.size > len ||
+        header.count > (len - sizeof(header)) / sizeof(rec)) {
+        return false;
+    }
+    /* Reserve for the works and their expirers at once */
+    count = 0;
+    for (i = 0; i < header.count; ++i) {
+        memcpy(&rec, (char *) buf + sizeof(header) + i * sizeof(rec), sizeof(rec));
+        if (rec.data_size && (rec.data_off > len || rec.data_size > len - rec.data_off)) {
+            return false;
+        }
+        count += (rec.flags & DO_SNAPSHOT_EXPIRY) ? 2 : 1;
+    }
+    if (!do_reserve(&doer->vector, count)) {
+        return false;
+    }
+    sz = vector_size(doer->vector);
+    for (i = 0; i < header.count; ++i) {
+        struct do_work *work;
+        memcpy(&rec, (char *) buf + sizeof(header) + i * sizeof(rec), sizeof(rec));
+        work = do_restore_work(&rec, (char *) buf);
+        if (!work) {
+            /* All or nothing */
+            while (vector_size(doer->vector) > sz) {
+                do_work_destroy(doer->vector[vector_size(doer->vector) - 1]);
+                vector_pop_back(doer->vector);
+            }
+            return false;
+        }
+        if (work->expirer) {
+            doer->vector[vector_size(doer->vector)] = work->expirer;
+            vector_set_size(doer->vector, vector_size(doer->vector) + 1);
+            work->expirer->doer = doer;
+        }
+        doer->vector[vector_size(doer->vector)] = work;
+        vector_set_size(doer->vector, vector_size(doer->vector) + 1);
+        work->doer = doer;
+    }
+    do_set_prio_changed(doer);
+    do_set_dirty(doer);
+    return true;
 }
 
 
@@ -65,12 +65,41 @@ typedef bool (*work_func)(void *);
 
 typedef bool (*returns_true_func)(void *);
 
+typedef time_t (*do_clock_func)(void *);
+
+/* Bit sets of <, == and > */
+enum do_cmp {
+    DO_CMP_LT = 1,
+    DO_CMP_EQ = 2,
+    DO_CMP_LE = 3,
+    DO_CMP_GT = 4,
+    DO_CMP_NE = 5,
+    DO_CMP_GE = 6
+};
+
+enum do_sched {
+    DO_SCHED_PRIO,  /* Static priority order, the default */
+    DO_SCHED_EDF    /* Earliest deadline first, ties broken by priority */
+};
+
+
+/* Counters of time predicate works that fired */
+struct do_timer_stats {
+    unsigned long fired;
+    unsigned long wakeups;      /* do_loop() calls at which at least one fired */
+    unsigned long coalesced;    /* Fired early within their slack, each saving a wakeup */
+};
+
 
 /* Opaque structs */
 struct do_doer;
 
 struct do_work;
 
+struct do_group;
+
+struct do_predicate;
+
 
 /* Doer */
 struct do_doer *do_init();
@@ -79,6 +108,30 @@ void do_destroy(struct do_doer *doer);
 
 void do_set_prio_changed(struct do_doer *doer);
 
+/* Number of threads offloaded works run on, set before the first work is offloaded */
+/* Returns false unless built with DO_THREADS, offloaded works then run in do_loop() */
+bool do_set_offload_threads(struct do_doer *doer, size_t n);
+
+/* Clock read once per do_loop() call, time(NULL) if not set */
+void do_set_clock(struct do_doer *doer, do_clock_func clock_fn, void *ctx);
+
+/* Clock returning the time_t pointed to by ctx, advance it by changing that value */
+time_t do_manual_clock(void *ctx);
+
+/* Time until which the doer is idle, false if some works need polling or none are timed */
+bool do_next_wakeup(struct do_doer *doer, time_t *tm);
+
+void do_get_timer_stats(struct do_doer *doer, struct do_timer_stats *stats);
+
+/* Within equal priorities, evaluates often true and cheap function predicates first */
+/* and backs off evaluating rarely true ones, which may then run a few ticks late */
+void do_set_adaptive(struct do_doer *doer, bool adaptive);
+
+void do_set_sched(struct do_doer *doer, enum do_sched sched);
+
+/* Caps the number of works run per do_loop() call, 0 means no cap */
+void do_set_admission(struct do_doer *doer, size_t max_runs);
+
 
 /* Work */
 struct do_work *do_work_init();
@@ -89,14 +142,60 @@ void do_work_set_work_func(struct do_work *work, work_func work_fn);
 
 void do_work_set_data(struct do_work *work, void *data);
 
+/* Size of the data blob, only needed for works that are snapshotted */
+void do_work_set_data_size(struct do_work *work, size_t size);
+
+/* Runs the work function on a background thread, its result is applied by a later do_loop() */
+/* It must not call into libdo, nor may the work be changed while it runs */
+void do_work_set_offload(struct do_work *work, bool offload);
+
 void do_work_set_prio(struct do_work *work, size_t prio);
 
+/* A time predicate may fire up to slack seconds late, to share a wakeup with other timers */
+void do_work_set_slack(struct do_work *work, time_t slack);
+
+void do_work_set_deadline(struct do_work *work, time_t deadline);
+
+void do_work_set_rate_limit(struct do_work *work, size_t runs, time_t period);
+
 void do_work_set_predicate_ptr(struct do_work *work, bool *predicate_p);
 
 void do_work_set_predicate_func(struct do_work *work, returns_true_func predicate_fn);
 
 void do_work_set_predicate_time(struct do_work *work, time_t predicate_tm);
 
+/* Evaluated inline by the doer, true if (*value_p cmp value) */
+void do_work_set_predicate_cmp(struct do_work *work, const long *value_p, enum do_cmp cmp, long value);
+
+/* Evaluated inline by the doer, true if (*word_p & mask) != 0 */
+void do_work_set_predicate_mask(struct do_work *work, const unsigned long *word_p, unsigned long mask);
+
+/* Takes ownership of the predicate */
+void do_work_set_predicate(struct do_work *work, struct do_predicate *predicate);
+
+
+/* Composite predicates */
+/* Function predicates are passed the work's data */
+struct do_predicate *do_predicate_ptr(bool *predicate_p);
+
+struct do_predicate *do_predicate_func(returns_true_func predicate_fn);
+
+struct do_predicate *do_predicate_time(time_t predicate_tm);
+
+struct do_predicate *do_predicate_cmp(const long *value_p, enum do_cmp cmp, long value);
+
+struct do_predicate *do_predicate_mask(const unsigned long *word_p, unsigned long mask);
+
+/* These take ownership of their operands, and destroy them on failure */
+/* Operands are reordered cheapest first, so they shouldn't rely on evaluation order */
+struct do_predicate *do_predicate_and(struct do_predicate *lhs, struct do_predicate *rhs);
+
+struct do_predicate *do_predicate_or(struct do_predicate *lhs, struct do_predicate *rhs);
+
+struct do_predicate *do_predicate_not(struct do_predicate *operand);
+
+void do_predicate_destroy(struct do_predicate *predicate);
+
 
 /* Convenience initializers */
 struct do_work *do_work_if(work_func work_fn, void *data, bool *predicate_p);
@@ -105,16 +204,61 @@ struct do_work *do_work_when(work_func work_fn, void *data, returns_true_func pr
 
 struct do_work *do_work_after(work_func work_fn, void *data, time_t tm);
 
+/* Wraps a child doer in a work, the child is looped only when some of its works may be ready */
+/* The work takes ownership of the child doer */
+struct do_work *do_work_doer(struct do_doer *child);
+
 
 /* Lifecycle */
 size_t do_loop(struct do_doer *doer);
 
 bool do_so(struct do_doer *doer, struct do_work *work);
 
+/* Adds all works or none of them, in a single grow and merge */
+bool do_so_batch(struct do_doer *doer, struct do_work **works, size_t n);
+
 bool do_so_until(struct do_doer *doer, struct do_work *work, time_t expiry_tm);
 
+/* Runs then in the same do_loop() call once work completes, without evaluating then's predicate */
+/* then is owned by work until that happens, fails if then already belongs to a doer or another work */
+bool do_then(struct do_work *work, struct do_work *then);
+
 void do_not_do(struct do_doer *doer, struct do_work *work);
 
+void do_not_do_batch(struct do_doer *doer, struct do_work **works, size_t n);
+
+
+/* Groups */
+/* Works added to a group are cancelled, paused or resumed together in O(1) */
+struct do_group *do_group_init();
+
+void do_group_destroy(struct do_group *group);
+
+bool do_so_in_group(struct do_doer *doer, struct do_work *work, struct do_group *group);
+
+void do_group_cancel(struct do_group *group);
+
+void do_group_pause(struct do_group *group);
+
+void do_group_resume(struct do_group *group);
+
+
+/* Snapshots */
+/* Functions are snapshotted by id, register them before do_snapshot() and do_restore() */
+bool do_register_work_func(unsigned long id, work_func work_fn);
+
+bool do_register_predicate_func(unsigned long id, returns_true_func predicate_fn);
+
+void do_clear_registry();
+
+/* Returns the snapshot size, nothing is written if buf is smaller than that */
+/* Only time and function predicate works are saved, works with bool ptr, compare, mask or */
+/* composite predicates, nested doers, groups, continuations or works running offloaded are skipped */
+size_t do_snapshot(struct do_doer *doer, void *buf, size_t len);
+
+/* Restored works use their data blobs in place, so buf must outlive them */
+bool do_restore(struct do_doer *doer, void *buf, size_t len);
+
 
 /* Fine tuning */
 void do_set_dyn_mem_func(do_malloc_func malloc_func, do_realloc_func realloc_func, do_free_func free_func);
@@ -0,0 +1,124 @@
+/*
+ This file is part of libdo
+
+ Copyright (c) 2018 Shoaib Ahmed
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+#ifndef LIB_DO_HPP
+#define LIB_DO_HPP
+
+#include <bitset>
+#include <cstddef>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+
+namespace libdo {
+
+/* A work of a static_doer, Predicate and Work are default constructible function objects returning bool */
+/* Works with a lower Prio run first, like do_work_set_prio() */
+template <typename Predicate, typename Work, std::size_t Prio = std::numeric_limits<std::size_t>::max()>
+struct static_work {
+    static constexpr std::size_t prio = Prio;
+    Predicate predicate;
+    Work work;
+};
+
+namespace detail {
+
+/* Number of works that run before work i, ties keep declaration order */
+template <std::size_t N>
+constexpr std::size_t rank(const std::size_t (&prios)[N], std::size_t i, std::size_t j = 0) {
+    return j == N ? 0 : ((prios[j] < prios[i] || (prios[j] == prios[i] && j < i)) ? 1 : 0) + rank(prios, i, j + 1);
+}
+
+/* Index of the work that runs at position r */
+template <std::size_t N>
+constexpr std::size_t at_rank(const std::size_t (&prios)[N], std::size_t r, std::size_t i = 0) {
+    return i == N ? N : (rank(prios, i) == r ? i : at_rank(prios, r, i + 1));
+}
+
+} /* namespace detail */
+
+/* Doer of a set of works known at compile time */
+/* Works are types with a static constexpr prio and predicate() and work() members returning bool */
+/* The loop is unrolled in priority order, so the compiler can inline the whole tick */
+template <typename... Works>
+class static_doer {
+    static_assert(sizeof...(Works) > 0, "static_doer needs at least one work");
+
+public:
+    static constexpr std::size_t size = sizeof...(Works);
+
+    static_doer() = default;
+
+    explicit static_doer(const Works &... works) : works_(works...) {}
+
+    /* Runs the works whose predicate is true, and removes those whose work returns true */
+    /* Returns the number of works left, like do_loop() */
+    std::size_t loop() {
+        step<0>();
+        return size - done_.count();
+    }
+
+    template <std::size_t I>
+    typename std::tuple_element<I, std::tuple<Works...>>::type &get() {
+        return std::get<I>(works_);
+    }
+
+    bool is_done(std::size_t i) const {
+        return done_.test(i);
+    }
+
+    /* Adds all works back */
+    void reset() {
+        done_.reset();
+    }
+
+private:
+    static constexpr std::size_t prios_[sizeof...(Works)] = {Works::prio...};
+
+    template <std::size_t R>
+    typename std::enable_if<(R < sizeof...(Works))>::type step() {
+        run<detail::at_rank(prios_, R)>();
+        step<R + 1>();
+    }
+
+    template <std::size_t R>
+    typename std::enable_if<(R == sizeof...(Works))>::type step() {}
+
+    template <std::size_t I>
+    void run() {
+        auto &w = std::get<I>(works_);
+        if (!done_.test(I) && w.predicate() && w.work()) {
+            done_.set(I);
+        }
+    }
+
+    std::tuple<Works...> works_;
+    std::bitset<sizeof...(Works)> done_;
+};
+
+template <typename... Works>
+constexpr std::size_t static_doer<Works...>::prios_[sizeof...(Works)];
+
+} /* namespace libdo */
+
+#endif /* LIB_DO_HPP */
@@ -48,12 +48,39 @@ void test_time_predicate(struct do_doer *doer);
 
 void test_periodic_with_expiry(struct do_doer *doer);
 
+void test_inline_predicates(struct do_doer *doer);
+
+void test_nested_doers(struct do_doer *doer);
+
+void test_groups(struct do_doer *doer);
+
+void test_rate_limit(struct do_doer *doer);
+
+void test_composite_predicates(struct do_doer *doer);
+
 void test_priorities(struct do_doer *doer);
 
+void test_edf(void);
+
+void test_snapshot(void);
+
+void test_batch(void);
+
+void test_offload(void);
+
+void test_timer_slack(void);
+
+void test_manual_clock(void);
+
+void test_adaptive(void);
+
+void test_continuations(void);
+
 static int tests_passed;
 static int tests_failed;
 static int runs;
 static size_t run_order[6] = {0};
+static time_t *clock_now;
 
 int main() {
     struct do_doer *doer;
@@ -67,8 +94,21 @@ int main() {
     test_func_predicate(doer);
     test_time_predicate(doer);
     test_periodic_with_expiry(doer);
+    test_inline_predicates(doer);
+    test_nested_doers(doer);
+    test_groups(doer);
+    test_rate_limit(doer);
+    test_composite_predicates(doer);
     test_priorities(doer);
     do_destroy(doer);
+    test_edf();
+    test_snapshot();
+    test_batch();
+    test_offload();
+    test_timer_slack();
+    test_manual_clock();
+    test_adaptive();
+    test_continuations();
     exit(EXIT_SUCCESS);
 }
 
@@ -155,6 +195,156 @@ void test_periodic_with_expiry(struct do_doer *doer) {
     TEST("Work-4 ran expected number of times", runs == until_sec);
 }
 
+void test_inline_predicates(struct do_doer *doer) {
+    long counter = 0;
+    unsigned long flags = 0;
+    struct do_work *work_cmp = do_work_init();
+    struct do_work *work_mask = do_work_init();
+    LOG("--- Test inline predicates ---");
+    runs = 0;
+    TEST("Works init", work_cmp && work_mask);
+    do_work_set_work_func(work_cmp, work2_func);
+    do_work_set_work_func(work_mask, work2_func);
+    do_work_set_predicate_cmp(work_cmp, &counter, DO_CMP_GE, 3);
+    do_work_set_predicate_mask(work_mask, &flags, 0x4);
+    TEST("Works added to doer", do_so(doer, work_cmp) && do_so(doer, work_mask));
+    counter = 2;
+    flags = 0x3;
+    TEST("Works don't run", do_loop(doer) == 2 && runs == 0);
+    counter = 3;
+    TEST("Compare work runs", do_loop(doer) == 2 && runs == 1);
+    flags = 0x5;
+    TEST("Both works run", do_loop(doer) == 2 && runs == 3);
+    do_work_set_predicate_cmp(work_cmp, &counter, DO_CMP_NE, 3);
+    TEST("Compare work doesn't run", do_loop(doer) == 2 && runs == 4);
+    do_not_do(doer, work_cmp);
+    do_not_do(doer, work_mask);
+    TEST("Works are removed", !do_loop(doer));
+}
+
+bool nested_work(void *data) {
+    (void) data;
+    runs++;
+    return true;
+}
+
+void test_nested_doers(struct do_doer *doer) {
+    bool run_work6 = false;
+    struct do_doer *child = do_init();
+    struct do_work *nested = do_work_doer(child);
+    struct do_work *work5 = do_work_after(nested_work, NULL, time(NULL));
+    struct do_work *work6 = do_work_if(nested_work, NULL, &run_work6);
+    struct do_doer *other = do_init();
+    LOG("--- Test nested doers ---");
+    runs = 0;
+    TEST("Nested doer init", child && nested);
+    TEST("Child doer can't be nested twice", !do_work_doer(child));
+    TEST("Nested doer added to doer", do_so(doer, nested));
+    TEST("Work-5 added to child doer", do_so(child, work5));
+    TEST("Work-5 runs through parent doer", do_loop(doer) == 1 && runs == 1);
+    TEST("Idle child doer is kept", do_loop(doer) == 1 && runs == 1);
+    TEST("Work-6 added to idle child doer", do_so(child, work6));
+    TEST("Work-6 doesn't run", do_loop(doer) == 1 && runs == 1);
+    run_work6 = true;
+    TEST("Work-6 runs through parent doer", do_loop(doer) == 1 && runs == 2);
+    TEST("Nested doer can't expire in another doer", other && !do_so_until(other, nested, time(NULL) + 60));
+    do_destroy(other);
+    TEST("Nested doer is kept in its doer", do_loop(doer) == 1 && runs == 2);
+    do_not_do(doer, nested);
+    TEST("Nested doer is removed", !do_loop(doer));
+}
+
+bool group_work(void *data) {
+    (void) data;
+    runs++;
+    return false;
+}
+
+bool group_predicate(void *data) {
+    (void) data;
+    runs += 10;
+    return true;
+}
+
+void test_groups(struct do_doer *doer) {
+    bool run_work = true;
+    struct do_group *group = do_group_init();
+    struct do_work *work7 = do_work_if(group_work, NULL, &run_work);
+    struct do_work *work8 = do_work_when(group_work, NULL, group_predicate);
+    struct do_work *work9 = do_work_if(group_work, NULL, &run_work);
+    LOG("--- Test groups ---");
+    runs = 0;
+    TEST("Group init", group);
+    TEST("Works init", work7 && work8 && work9);
+    TEST("Work-7 added to group", do_so_in_group(doer, work7, group));
+    TEST("Work-8 added to group", do_so_in_group(doer, work8, group));
+    TEST("Work-9 added to doer", do_so(doer, work9));
+    TEST("Works run", do_loop(doer) == 3 && runs == 13);
+    do_group_pause(group);
+    runs = 0;
+    TEST("Paused works are skipped", do_loop(doer) == 3 && runs == 1);
+    do_group_resume(group);
+    runs = 0;
+    TEST("Resumed works run", do_loop(doer) == 3 && runs == 13);
+    do_group_cancel(group);
+    runs = 0;
+    TEST("Cancelled works are removed", do_loop(doer) == 1 && runs == 1);
+    do_not_do(doer, work9);
+    TEST("Work-9 is removed", !do_loop(doer));
+    do_group_destroy(group);
+}
+
+void test_rate_limit(struct do_doer *doer) {
+    struct do_work *work10 = do_work_when(group_work, NULL, group_predicate);
+    LOG("--- Test rate limit ---");
+    runs = 0;
+    TEST("Work-10 init with func predicate", work10);
+    do_work_set_rate_limit(work10, 2, 60);
+    TEST("Work-10 added to doer", do_so(doer, work10));
+    do_loop(doer);
+    do_loop(doer);
+    TEST("Work-10 runs up to its limit", runs == 22);
+    do_loop(doer);
+    TEST("Throttled work-10 isn't evaluated", runs == 22);
+    do_work_set_rate_limit(work10, 0, 0);
+    do_loop(doer);
+    TEST("Work-10 runs once unlimited", runs == 33);
+    do_not_do(doer, work10);
+    TEST("Work-10 is removed", !do_loop(doer));
+}
+
+void test_composite_predicates(struct do_doer *doer) {
+    bool flag = true;
+    long counter = 0;
+    unsigned long flags = 0;
+    struct do_work *w1 = do_work_init();
+    struct do_work *w2 = do_work_init();
+    struct do_work *w3 = do_work_init();
+    struct do_predicate *p1 = do_predicate_and(do_predicate_func(group_predicate), do_predicate_time(time(NULL) + 60));
+    struct do_predicate *p2 = do_predicate_or(do_predicate_not(do_predicate_ptr(&flag)),
+                                              do_predicate_cmp(&counter, DO_CMP_GE, 1));
+    struct do_predicate *p3 = do_predicate_and(do_predicate_func(group_predicate), do_predicate_mask(&flags, 0x1));
+    LOG("--- Test composite predicates ---");
+    runs = 0;
+    TEST("Composite predicates init", p1 && p2 && p3);
+    do_work_set_work_func(w1, group_work);
+    do_work_set_work_func(w2, group_work);
+    do_work_set_work_func(w3, group_work);
+    do_work_set_predicate(w1, p1);
+    do_work_set_predicate(w2, p2);
+    do_work_set_predicate(w3, p3);
+    TEST("Works added to doer", do_so(doer, w1) && do_so(doer, w2) && do_so(doer, w3));
+    TEST("Cheap terms short-circuit", do_loop(doer) == 3 && runs == 0);
+    counter = 1;
+    TEST("OR work runs", do_loop(doer) == 3 && runs == 1);
+    flags = 0x1;
+    TEST("AND work runs", do_loop(doer) == 3 && runs == 13);
+    do_not_do(doer, w1);
+    do_not_do(doer, w2);
+    do_not_do(doer, w3);
+    TEST("Works are removed", !do_loop(doer));
+}
+
 bool prio_work(void *data) {
     size_t *id = data;
     run_order[runs++] = *id;
@@ -231,3 +421,332 @@ void test_priorities(struct do_doer *doer) {
     do_loop(doer);
     TEST("Works ran in order -> {1, 3, 5, 2, 4, 6}", orders_match(run_order, order, 6));
 }
+
+bool clear_work(void *data) {
+    *((bool *) data) = false;
+    runs++;
+    return true;
+}
+
+bool set_work(void *data) {
+    *((bool *) data) = true;
+    runs++;
+    return true;
+}
+
+void test_edf(void) {
+    bool run_work = true, set = true;
+    struct do_timer_stats stats;
+    size_t ids[4] = {1, 2, 3, 4};
+    time_t now_tm = time(NULL);
+    struct do_doer *doer = do_init();
+    struct do_work *w1 = do_work_if(prio_work, &ids[0], &run_work);
+    struct do_work *w2 = do_work_if(prio_work, &ids[1], &run_work);
+    struct do_work *w3 = do_work_if(prio_work, &ids[2], &run_work);
+    struct do_work *w4 = do_work_if(prio_work, &ids[3], &run_work);
+
+    LOG("--- Test earliest deadline first ---");
+    TEST("EDF doer init", doer);
+    TEST("Works init with bool ptr predicate", w1 && w2 && w3 && w4);
+    do_set_sched(doer, DO_SCHED_EDF);
+    do_work_set_prio(w1, 1);
+    do_work_set_deadline(w2, now_tm + 30);
+    do_work_set_deadline(w3, now_tm + 10);
+    do_work_set_prio(w4, 2);
+    do_work_set_deadline(w4, now_tm + 30);
+    do_so(doer, w1);
+    do_so(doer, w2);
+    do_so(doer, w3);
+    do_so(doer, w4);
+
+    runs = 0;
+    do_loop(doer);
+    TEST("Works ran in order -> {3, 4, 2, 1}", runs == 4 &&
+            run_order[0] == 3 && run_order[1] == 4 && run_order[2] == 2 && run_order[3] == 1);
+
+    do_set_admission(doer, 2);
+    runs = 0;
+    do_loop(doer);
+    TEST("Admission caps runs per loop -> {3, 4}", runs == 2 && run_order[0] == 3 && run_order[1] == 4);
+    do_destroy(doer);
+
+    doer = do_init();
+    w1 = do_work_if(clear_work, &run_work, &run_work);
+    w2 = do_work_if(prio_work, &ids[1], &run_work);
+    TEST("EDF doer init", doer && w1 && w2);
+    do_set_sched(doer, DO_SCHED_EDF);
+    do_work_set_deadline(w1, now_tm + 10);
+    do_work_set_deadline(w2, now_tm + 30);
+    do_so(doer, w2);
+    do_so(doer, w1);
+    runs = 0;
+    TEST("Predicate cleared by an earlier work is re-evaluated", do_loop(doer) == 1 && runs == 1);
+    do_destroy(doer);
+
+    doer = do_init();
+    run_work = false;
+    w1 = do_work_if(set_work, &run_work, &set);
+    w2 = do_work_if(prio_work, &ids[1], &run_work);
+    TEST("EDF doer init", doer && w1 && w2);
+    do_set_sched(doer, DO_SCHED_EDF);
+    do_work_set_deadline(w1, now_tm + 10);
+    do_work_set_deadline(w2, now_tm + 30);
+    do_so(doer, w1);
+    do_so(doer, w2);
+    runs = 0;
+    TEST("Works that aren't ready aren't popped", do_loop(doer) == 1 && runs == 1);
+    TEST("Work made ready runs on the next tick", do_loop(doer) == 1 && runs == 2 && run_order[1] == 2);
+    do_destroy(doer);
+
+    doer = do_init();
+    w1 = do_work_after(work3_func, NULL, now_tm);
+    w2 = do_work_after(work3_func, NULL, now_tm);
+    TEST("EDF doer init", doer && w1 && w2);
+    do_set_sched(doer, DO_SCHED_EDF);
+    do_set_admission(doer, 1);
+    do_so(doer, w1);
+    do_so(doer, w2);
+    do_loop(doer);
+    do_get_timer_stats(doer, &stats);
+    TEST("Works held back by admission aren't counted as fired", stats.fired == 1);
+    do_destroy(doer);
+}
+
+bool snapshot_work(void *data) {
+    runs += *((int *) data);
+    return true;
+}
+
+bool snapshot_predicate(void *data) {
+    (void) data;
+    return false;
+}
+
+void test_snapshot(void) {
+    bool run_work = true;
+    int blob = 42;
+    size_t sz;
+    char *buf;
+    struct do_doer *doer = do_init();
+    struct do_work *w1 = do_work_after(snapshot_work, &blob, time(NULL));
+    struct do_work *w2 = do_work_when(snapshot_work, &blob, snapshot_predicate);
+    struct do_work *w3 = do_work_if(snapshot_work, &blob, &run_work);
+
+    LOG("--- Test snapshot and restore ---");
+    TEST("Snapshot doer init", doer);
+    TEST("Works init", w1 && w2 && w3);
+    TEST("Functions registered", do_register_work_func(1, snapshot_work) &&
+            do_register_predicate_func(2, snapshot_predicate));
+    TEST("Function ids are unique", !do_register_work_func(1, work1_func));
+    do_work_set_data_size(w1, sizeof(blob));
+    do_work_set_data_size(w2, sizeof(blob));
+    do_work_set_data_size(w3, sizeof(blob));
+    do_so_until(doer, w1, time(NULL) + 60);
+    do_so(doer, w2);
+    do_so(doer, w3);
+    sz = do_snapshot(doer, NULL, 0);
+    buf = malloc(sz);
+    TEST("Snapshot written", buf && do_snapshot(doer, buf, sz) == sz);
+    do_destroy(doer);
+    blob = 0;
+
+    doer = do_init();
+    TEST("Snapshot restored", do_restore(doer, buf, sz));
+    runs = 0;
+    TEST("Restored works run with their data", do_loop(doer) == 1 && runs == 42);
+    do_destroy(doer);
+    do_clear_registry();
+    TEST("Restore fails without registered functions", !do_restore(doer = do_init(), buf, sz));
+    do_destroy(doer);
+    free(buf);
+}
+
+void test_batch(void) {
+    bool run_work = true;
+    size_t i, prios[6] = {2, 4, 5, 1, 3, 2};
+    size_t ids[6] = {1, 2, 3, 4, 5, 6};
+    struct do_work *works[6];
+    struct do_doer *doer = do_init();
+
+    LOG("--- Test batch ---");
+    TEST("Batch doer init", doer);
+    for (i = 0; i < 6; ++i) {
+        works[i] = do_work_if(prio_work, &ids[i], &run_work);
+        do_work_set_prio(works[i], prios[i]);
+    }
+    TEST("Works added to doer", do_so(doer, works[0]) && do_so(doer, works[1]));
+    runs = 0;
+    do_loop(doer);
+    TEST("Works added as batch", do_so_batch(doer, &works[2], 4));
+    TEST("Empty batch added", do_so_batch(doer, NULL, 0));
+    runs = 0;
+    TEST("Batch is merged", do_loop(doer) == 6);
+    TEST("Works ran in order -> {4, 1, 6, 5, 2, 3}", runs == 6 && run_order[0] == 4 && run_order[1] == 1 &&
+            run_order[2] == 6 && run_order[3] == 5 && run_order[4] == 2 && run_order[5] == 3);
+    do_not_do_batch(doer, works, 6);
+    TEST("Works removed as batch", !do_loop(doer));
+    do_destroy(doer);
+}
+
+bool offload_work(void *data) {
+    (void) data;
+    runs++;
+    return true;
+}
+
+void test_offload(void) {
+    bool run_work = true, threaded;
+    size_t sz;
+    struct do_doer *doer = do_init();
+    struct do_work *work = do_work_if(offload_work, NULL, &run_work), *then;
+
+    LOG("--- Test offload ---");
+    TEST("Offload doer init", doer);
+    TEST("Work init with bool ptr predicate", work);
+    /* Without threads, offloaded works run in do_loop() */
+    threaded = do_set_offload_threads(doer, 1);
+    do_work_set_offload(work, true);
+    TEST("Work added to doer", do_so(doer, work));
+    runs = 0;
+    TEST("Offloaded work is kept until its result is applied", do_loop(doer) == (threaded ? 1u : 0u));
+    TEST("Offload threads can't change once started", !do_set_offload_threads(doer, 2));
+    while (do_loop(doer));
+    TEST("Offloaded work ran once and is removed", runs == 1);
+    work = do_work_if(offload_work, NULL, &run_work);
+    then = do_work_if(offload_work, NULL, &run_work);
+    TEST("Works init with bool ptr predicate", work && then);
+    do_work_set_offload(work, true);
+    TEST("Continuation chained to offloaded work", do_then(work, then) && do_so(doer, work));
+    runs = 0;
+    do_loop(doer);
+    do_not_do(doer, work);
+    while (do_loop(doer));
+    TEST("Continuation skipped if removed in flight", runs == (threaded ? 1 : 2));
+    work = do_work_after(offload_work, NULL, time(NULL));
+    TEST("Work init with time predicate", work && do_register_work_func(1, offload_work));
+    do_work_set_offload(work, true);
+    sz = do_snapshot(doer, NULL, 0);
+    TEST("Offloaded work added to doer", do_so(doer, work) && do_snapshot(doer, NULL, 0) > sz);
+    do_loop(doer);
+    TEST("Work running offloaded isn't snapshotted", do_snapshot(doer, NULL, 0) == sz);
+    while (do_loop(doer));
+    do_clear_registry();
+    do_destroy(doer);
+}
+
+void test_timer_slack(void) {
+    time_t now_tm = time(NULL), wakeup_tm = 0;
+    struct do_timer_stats stats;
+    struct do_doer *doer = do_init();
+    struct do_work *w1 = do_work_after(work3_func, NULL, now_tm);
+    struct do_work *w2 = do_work_after(work3_func, NULL, now_tm - 1);
+    struct do_work *w3 = do_work_after(work3_func, NULL, now_tm - 1);
+
+    LOG("--- Test timer slack ---");
+    TEST("Slack doer init", doer);
+    TEST("Works init with time predicate", w1 && w2 && w3);
+    do_work_set_slack(w2, 100);
+    do_work_set_slack(w3, 100);
+    TEST("Works added to doer", do_so(doer, w1) && do_so(doer, w2));
+    TEST("Slack work fires with a due timer", !do_loop(doer));
+    TEST("Work added to doer", do_so(doer, w3));
+    TEST("Slack work waits without a due timer", do_loop(doer) == 1);
+    TEST("Doer is idle until slack runs out", do_next_wakeup(doer, &wakeup_tm) && wakeup_tm == now_tm + 99);
+    do_get_timer_stats(doer, &stats);
+    TEST("Timer stats count the saved wakeup", stats.fired == 2 && stats.wakeups == 1 && stats.coalesced == 1);
+    do_destroy(doer);
+}
+
+bool clock_work(void *data) {
+    runs++;
+    do_work_set_predicate_time(data, do_manual_clock(clock_now) + 60);
+    return false;
+}
+
+void test_manual_clock(void) {
+    time_t now_tm = 0;
+    struct do_doer *doer = do_init();
+    struct do_doer *child = do_init();
+    struct do_work *nested = do_work_doer(child);
+    struct do_work *work = do_work_after(clock_work, NULL, 60);
+
+    LOG("--- Test manual clock ---");
+    TEST("Clock doers init", doer && child && nested && work);
+    clock_now = &now_tm;
+    do_set_clock(doer, do_manual_clock, &now_tm);
+    do_work_set_data(work, work);
+    do_so(doer, nested);
+    do_so(child, work);
+    runs = 0;
+    TEST("Work doesn't run before its time", do_loop(doer) == 1 && runs == 0);
+    for (now_tm = 0; now_tm < 24 * 60 * 60; now_tm++) {
+        do_loop(doer);
+    }
+    TEST("Nested work ran every minute for a simulated day", runs == 24 * 60 - 1);
+    do_destroy(doer);
+}
+
+bool rare_predicate(void *data) {
+    (*((int *) data))++;
+    return false;
+}
+
+void test_adaptive(void) {
+    int i, evals = 0;
+    bool run_work = true;
+    struct do_doer *doer = do_init();
+    struct do_work *w1 = do_work_when(group_work, &evals, rare_predicate);
+    struct do_work *w2 = do_work_if(group_work, NULL, &run_work);
+
+    LOG("--- Test adaptive predicate ordering ---");
+    TEST("Adaptive doer init", doer);
+    TEST("Works init", w1 && w2);
+    do_set_adaptive(doer, true);
+    do_work_set_prio(w2, 1);
+    do_so(doer, w1);
+    do_so(doer, w2);
+    runs = 0;
+    for (i = 0; i < 256; ++i) {
+        do_loop(doer);
+    }
+    TEST("Higher priority work ran every tick", runs == 256);
+    TEST("Rarely true predicate is backed off", evals > 16 && evals < 128);
+    do_destroy(doer);
+}
+
+bool then_work(void *data) {
+    prio_work(data);
+    return true;
+}
+
+void test_continuations(void) {
+    bool run_work = true;
+    size_t ids[3] = {1, 2, 3};
+    struct do_doer *doer = do_init();
+    struct do_work *w1 = do_work_if(then_work, &ids[0], &run_work);
+    struct do_work *w2 = do_work_if(then_work, &ids[1], &run_work);
+    struct do_work *w3 = do_work_init();
+    struct do_work *w4 = do_work_init();
+
+    LOG("--- Test continuations ---");
+    TEST("Continuation doer init", doer);
+    TEST("Works init", w1 && w2 && w3 && w4);
+    do_work_set_work_func(w3, then_work);
+    do_work_set_data(w3, &ids[2]);
+    /* Higher priority than w1, so it would only run on the next tick if polled */
+    do_work_set_prio(w2, 1);
+    do_work_set_prio(w1, 2);
+    TEST("Continuations chained", do_then(w1, w2) && do_then(w2, w3));
+    TEST("Continuation can't be chained twice", !do_then(w1, w3));
+    TEST("Continuation cycle rejected", !do_then(w3, w1));
+    TEST("Continuation can't have two owners", !do_then(w4, w3));
+    TEST("Continuation can't be added to a doer", !do_so(doer, w3));
+    TEST("Continuation can't be added with an expiry", !do_so_until(doer, w3, time(NULL) + 60));
+    do_work_destroy(w4);
+    do_so(doer, w1);
+    runs = 0;
+    TEST("Chain completes in one tick", !do_loop(doer));
+    TEST("Works ran in order -> {1, 2, 3}", runs == 3 &&
+            run_order[0] == 1 && run_order[1] == 2 && run_order[2] == 3);
+    do_destroy(doer);
+}
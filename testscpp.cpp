@@ -26,11 +26,46 @@
 #include <chrono>
 #include <thread>
 #include "libdo.h"
+#include "libdo.hpp"
 
 static int run_after_iterations = 5;
 
+static std::vector<int> run_order;
+
+struct always {
+    bool operator()() const { return true; }
+};
+
+template <int Id, bool Done>
+struct record {
+    bool operator()() const {
+        run_order.push_back(Id);
+        return Done;
+    }
+};
+
+static void test_static_doer() {
+    libdo::static_doer<
+            libdo::static_work<always, record<1, true>, 3>,
+            libdo::static_work<always, record<2, false>, 1>,
+            libdo::static_work<always, record<3, true>, 2>
+    > sd;
+
+    std::cout << "--- Static doer runs works in priority order ---" << std::endl;
+    if (sd.loop() != 1 || run_order != std::vector<int>{2, 3, 1}) {
+        std::cout << "> FAIL" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (sd.loop() != 1 || run_order != std::vector<int>{2, 3, 1, 2} || !sd.is_done(0) || sd.is_done(1)) {
+        std::cout << "> FAIL" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "> OK" << std::endl;
+}
+
 int main() {
     int iterations = 0;
+    test_static_doer();
     auto d = do_init();
     if (!d) {
         exit(EXIT_FAILURE);